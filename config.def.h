@@ -15,6 +15,16 @@ static const char *colors[SchemeLast][2] = {
 };
 /* -l option; if nonzero, dmenu uses vertical list with given number of lines */
 static unsigned int lines      = 0;
+/* -j option; number of threads matching large item lists, 0 uses all processors */
+static unsigned int jobs       = 1;
+/* -s option; minimum time in ms between redraws while items are still read */
+static unsigned int refreshrate = 50;
+/* time in ms to wait for more typing before matching, 0 matches right away */
+static unsigned int debounce   = 0;
+/* days after which a selection counts half when ranking popular items */
+static unsigned int halflife   = 30;
+/* number of items whose popularity is kept, 0 for no limit */
+static unsigned int popmax     = 2000;
 
 /*
  * Characters not considered part of a word while deleting words
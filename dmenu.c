@@ -1,6 +1,19 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,27 +36,120 @@
 #define INTERSECT(x,y,w,h,r)  (MAX(0, MIN((x)+(w),(r).x_org+(r).width)  - MAX((x),(r).x_org)) \
                              * MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define MATCHSETS             8 /* earlier result sets kept for narrowing */
+#define MATCHCHUNK            8192 /* minimum number of items per matcher thread */
+#define MATCHSLICE            65536 /* candidates scanned between checks for input */
+#define SORTHEAD              256 /* results ordered right away, at least 4 pages */
+#define CHUNKMIN              (64 * 1024) /* initial size of a stdin text chunk */
+#define CHUNKMAX              (16 * 1024 * 1024)
+#define POPMAGIC              "dmp" /* popularity database, see struct pophdr */
+#define POPVERSION            2
+#define FUZZYMATCH            16 /* score of a character matched with -F */
+#define FUZZYGAPSTART         -3 /* for skipping text between matches */
+#define FUZZYGAPEXT           -1 /* per further character skipped */
+#define FUZZYCONSEC           4 /* least bonus of a match following a match */
+#define FUZZYNONE             (INT_MIN / 4) /* no match possible */
 
 /* enums */
 enum { SchemeNorm, SchemeSel, SchemeOut, SchemeLast }; /* color schemes */
+enum { DirtyMatch = 1 << 0, DirtyDraw = 1 << 1, DirtyList = 1 << 2 }; /* deferred work */
+enum { TimerRefresh, TimerMatch, TimerLast }; /* timers */
+enum { CharWhite, CharDelim, CharNonWord, CharLower, CharUpper, CharDigit }; /* for -F */
 
 struct item {
 	char *text;
+	char *ftext; /* case-folded copy of text with -i, text otherwise */
 	struct item *left, *right;
+	unsigned int len; /* of text in bytes */
+	unsigned int w, wmax; /* width of text as measured clamped to wmax */
+	uint32_t rank; /* in the popularity database from 1, 0 if not in it */
+	uint64_t mask; /* charbits of the bytes in text */
 	int out;
 };
 
+/* The popularity database is a header, the entries sorted by text and
+ * then their NUL-terminated texts, all in host byte order. */
+struct pophdr {
+	char magic[4];
+	uint32_t version;
+	uint32_t n;       /* number of entries */
+	uint32_t strsize; /* size of the texts */
+};
+
+struct popent {
+	int64_t last; /* time of the last selection */
+	float count;  /* selections, decayed up to last */
+	uint32_t off; /* of the text, from the end of the entries */
+};
+
+struct matchjob {
+	size_t lo, hi; /* range of candidates to test */
+	int *row;      /* scores and run bonuses with -F */
+	size_t rowsize;
+};
+
+struct matchset {
+	char *text;          /* query the results were computed for */
+	struct item **items; /* results in list order */
+	size_t n, size;
+	size_t nitems;       /* number of items read when it was computed */
+};
+
 static char text[BUFSIZ] = "";
 static char *embed;
-static char *popcache = NULL;
+static char *popdb; /* path of the popularity database */
 static int bh, mw, mh;
 static int inputw = 0, promptw;
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
 static struct item *items = NULL;
-static struct item *popitems = NULL;
+static size_t nitems;
+static char **chunks; /* text of the items, lines are split in place */
+static size_t nchunks;
+static char *chunk; /* chunk being filled */
+static size_t chunklen, chunksize, linestart;
+static char *fchunk; /* case-folded twin of chunk with -i */
+static char *pathmap; /* cached list of executables with -P */
+static size_t pathmapsize;
+static unsigned char foldtab[256];
+static int fold;
+static int fuzzy; /* match items having the tokens as subsequence */
+static uint64_t charbits[256]; /* a bit per byte, some shared */
+static int reading; /* stdin is read in the background */
+static int dirty;
+static long long timers[TimerLast]; /* deadlines in ms, 0 if not armed */
+static unsigned char *popmap; /* popularity database, mapped read-only */
+static size_t popmapsize;
+static struct popent *popents, **poprank; /* by text and by score */
+static double *popscore; /* decayed counts of popents at startup */
+static const char *popstr;
+static uint32_t npop;
+static struct popslot { uint32_t hash, rank; } *pophash; /* ranks by text */
+static uint32_t pophashsize;
 static struct item *matches, *matchend;
 static struct item *prev, *curr, *next, *sel;
+static struct matchset sets[MATCHSETS];
+static int nsets;
+#ifdef STATS
+static unsigned long statsreq; /* first request of the key press measured */
+static long long statstime;
+#endif
+
+/* state shared with the matcher threads, read-only while they run */
+static struct item **mcand; /* cached results to filter, then new items */
+static size_t mcandn, mtail;
+static char mtokbuf[BUFSIZ], **mtokv;
+static int mtokc;
+static char mtext[BUFSIZ]; /* text, case-folded with -i */
+static size_t mtextlen, mtokmax;
+static struct matchjob mjob[64]; /* one per thread */
+static uint64_t mtokmask;   /* charbits of the tokens */
+static uint16_t *mres;      /* per candidate: 0 no match, else its order + 1 */
+static uint64_t *mkeys;     /* results by order, see itemkey() */
+static size_t mkeysn, mhead; /* results, of which the first mhead are linked */
+static size_t mdone, mn;    /* progress of the scan */
+static size_t mnitems;      /* items read when the scan was started */
+static int scanning;        /* a scan is in progress, see matchstep() */
 static int mon = -1, screen;
 
 static Atom clip, utf8;
@@ -56,14 +162,16 @@ static Clr *scheme[SchemeLast];
 
 #include "config.h"
 
-static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
-
 static unsigned int
-textw_clamp(const char *str, unsigned int n)
+textw_clamp(struct item *item, unsigned int n)
 {
-	unsigned int w = drw_fontset_getwidth_clamp(drw, str, n) + lrpad;
-	return MIN(w, n);
+	/* the cached width is exact unless it reached wmax, so it has to be
+	 * measured again only when clamped and asked for more room */
+	if (!item->wmax || (item->w >= item->wmax && n > item->wmax)) {
+		item->w = drw_fontset_getwidth_clamp(drw, item->text, n);
+		item->wmax = n;
+	}
+	return MIN(item->w + lrpad, n);
 }
 
 static void
@@ -79,6 +187,96 @@ appenditem(struct item *item, struct item **list, struct item **last)
 	*last = item;
 }
 
+/* 1 if item is an exact match of the text, 2 if it starts with it, else 3 */
+static int
+matchclass(struct item *item)
+{
+	if (!mtokc || (item->len == mtextlen && !memcmp(item->ftext, mtext, mtextlen)))
+		return 1;
+	if (item->len > mtextlen && !memcmp(item->ftext, mtext, mtextlen))
+		return 2;
+	return 3;
+}
+
+/* results are ordered by a key: the order res the matcher found, their
+ * class or inverted fuzzy score, then by popularity, then in input order */
+static uint64_t
+itemkey(struct item *item, unsigned int res)
+{
+	uint64_t rank = item->rank && item->rank <= npop ? item->rank - 1 : 0xFFFF;
+
+	return (uint64_t)(res - 1) << 48 | MIN(rank, 0xFFFF) << 32 | (uint64_t)(item - items);
+}
+
+static int
+comparekey(const void *lhs, const void *rhs)
+{
+	uint64_t a = *(uint64_t *)lhs, b = *(uint64_t *)rhs;
+
+	return a < b ? -1 : a > b;
+}
+
+/* partition the n keys of v so that the k smallest come first */
+static void
+selectkeys(uint64_t *v, size_t n, size_t k)
+{
+	size_t lo = 0, hi = n - 1, i, j;
+	uint64_t pivot, t;
+
+	while (lo < hi) {
+		pivot = v[lo + (hi - lo) / 2];
+		for (i = lo, j = hi; i <= j;) {
+			while (v[i] < pivot)
+				i++;
+			while (v[j] > pivot)
+				j--;
+			if (i <= j) {
+				t = v[i];
+				v[i++] = v[j];
+				v[j] = t;
+				if (!j--)
+					break;
+			}
+		}
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
+/* make the n results in mkeys the match list: only the first few pages
+ * are sorted and linked, sortrest() adds the rest once it is reached */
+static void
+linkresults(size_t n)
+{
+	size_t j;
+
+	mkeysn = n;
+	mhead = MIN(n, MAX(SORTHEAD, 4 * lines));
+	if (mhead < n)
+		selectkeys(mkeys, n, mhead);
+	qsort(mkeys, mhead, sizeof *mkeys, comparekey);
+	matches = matchend = NULL;
+	for (j = 0; j < mhead; j++)
+		appenditem(&items[(uint32_t)mkeys[j]], &matches, &matchend);
+}
+
+static void
+sortrest(void)
+{
+	size_t j;
+
+	if (mhead == mkeysn)
+		return;
+	qsort(mkeys + mhead, mkeysn - mhead, sizeof *mkeys, comparekey);
+	for (j = mhead; j < mkeysn; j++)
+		appenditem(&items[(uint32_t)mkeys[j]], &matches, &matchend);
+	mhead = mkeysn;
+}
+
 static void
 calcoffsets(void)
 {
@@ -89,11 +287,15 @@ calcoffsets(void)
 	else
 		n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
 	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? bh : textw_clamp(next->text, n)) > n)
+	for (i = 0, next = curr; next; next = next->right) {
+		if ((i += (lines > 0) ? bh : textw_clamp(next, n)) > n)
 			break;
+		/* the page goes on past the results linked so far */
+		if (!next->right)
+			sortrest();
+	}
 	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? bh : textw_clamp(prev->left->text, n)) > n)
+		if ((i += (lines > 0) ? bh : textw_clamp(prev->left, n)) > n)
 			break;
 }
 
@@ -105,38 +307,32 @@ cleanup(void)
 	XUngrabKeyboard(dpy, CurrentTime);
 	for (i = 0; i < SchemeLast; i++)
 		free(scheme[i]);
-	for (i = 0; items && items[i].text; ++i)
-		free(items[i].text);
-	for (i = 0; popitems && popitems[i].text; ++i)
-		free(popitems[i].text);
+	for (i = 0; i < nchunks; i++)
+		free(chunks[i]);
+	free(chunks);
+	if (pathmap)
+		munmap(pathmap, pathmapsize);
 	free(items);
-	free(popitems);
-	if(popcache != NULL)
-		free(popcache);
+	if (popmap)
+		munmap(popmap, popmapsize);
+	free(poprank);
+	free(popscore);
+	free(pophash);
+	free(popdb);
+	free(mres);
+	free(mkeys);
+	for (i = 0; i < LENGTH(mjob); i++)
+		free(mjob[i].row);
+	for (i = 0; i < MATCHSETS; i++) {
+		free(sets[i].text);
+		free(sets[i].items);
+	}
 
 	drw_free(drw);
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
 }
 
-static char *
-cistrstr(const char *h, const char *n)
-{
-	size_t i;
-
-	if (!n[0])
-		return (char *)h;
-
-	for (; *h; ++h) {
-		for (i = 0; n[i] && tolower((unsigned char)n[i]) ==
-		            tolower((unsigned char)h[i]); ++i)
-			;
-		if (n[i] == '\0')
-			return (char *)h;
-	}
-	return NULL;
-}
-
 static int
 drawitem(struct item *item, int x, int y, int w)
 {
@@ -150,30 +346,62 @@ drawitem(struct item *item, int x, int y, int w)
 	return drw_text(drw, x, y, w, bh, lrpad / 2, item->text, 0);
 }
 
+static int
+drawinput(int x)
+{
+	unsigned int curpos;
+	int w = (lines > 0 || !matches) ? mw - x : inputw;
+
+	drw_setscheme(drw, scheme[SchemeNorm]);
+	drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
+
+	curpos = TEXTW(text) - TEXTW(&text[cursor]);
+	if ((curpos += lrpad / 2 - 1) < w) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_rect(drw, x + curpos, 2, 2, bh - 4, 1, 0);
+	}
+	return w;
+}
+
 static void
 drawmenu(void)
 {
-	unsigned int curpos;
+	/* what is on the window, to redraw only what changed since */
+	static struct item *lastcurr, *lastnext, *lastsel;
+	static char lasttext[sizeof text];
+	static size_t lastcursor;
+	static int drawn;
+
 	struct item *item;
 	int x = 0, y = 0, w;
 
+	if (prompt && *prompt)
+		x = promptw;
+	if (drawn && !(dirty & DirtyList) && curr == lastcurr && next == lastnext &&
+	    (lines > 0 || sel == lastsel)) {
+		if (cursor != lastcursor || strcmp(text, lasttext)) {
+			w = drawinput(x);
+			drw_map(drw, win, x, 0, w, bh);
+		}
+		/* only the rows of the old and new selection in a vertical list */
+		for (item = curr; sel != lastsel && item != next; item = item->right) {
+			y += bh;
+			if (item == sel || item == lastsel) {
+				drawitem(item, x, y, mw - x);
+				drw_map(drw, win, x, y, mw - x, bh);
+			}
+		}
+		goto done;
+	}
+
 	drw_setscheme(drw, scheme[SchemeNorm]);
 	drw_rect(drw, 0, 0, mw, mh, 1, 1);
 
 	if (prompt && *prompt) {
 		drw_setscheme(drw, scheme[SchemeSel]);
-		x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0);
-	}
-	/* draw input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
-
-	curpos = TEXTW(text) - TEXTW(&text[cursor]);
-	if ((curpos += lrpad / 2 - 1) < w) {
-		drw_setscheme(drw, scheme[SchemeNorm]);
-		drw_rect(drw, x + curpos, 2, 2, bh - 4, 1, 0);
+		x = drw_text(drw, 0, 0, promptw, bh, lrpad / 2, prompt, 0);
 	}
+	drawinput(x);
 
 	if (lines > 0) {
 		/* draw vertical list */
@@ -189,7 +417,7 @@ drawmenu(void)
 		}
 		x += w;
 		for (item = curr; item != next; item = item->right)
-			x = drawitem(item, x, 0, textw_clamp(item->text, mw - x - TEXTW(">")));
+			x = drawitem(item, x, 0, textw_clamp(item, mw - x - TEXTW(">")));
 		if (next) {
 			w = TEXTW(">");
 			drw_setscheme(drw, scheme[SchemeNorm]);
@@ -197,6 +425,14 @@ drawmenu(void)
 		}
 	}
 	drw_map(drw, win, 0, 0, mw, mh);
+	drawn = 1;
+done:
+	lastcurr = curr;
+	lastnext = next;
+	lastsel = sel;
+	lastcursor = cursor;
+	strcpy(lasttext, text);
+	dirty &= ~DirtyList;
 }
 
 static void
@@ -234,99 +470,670 @@ grabkeyboard(void)
 	die("cannot grab keyboard");
 }
 
-static void
-sortitemsbypop(struct item* first, struct item* last)
+static int
+comparepopbyscorerev(const void *lhs, const void *rhs)
 {
-	struct item* item = NULL;
-	struct item* pop = NULL;
-	size_t idx = 0;
-	for (pop = popitems; pop && pop->text; ++pop) {
-		for (item = first; item && item->text && (item <= last || last == NULL); item++) {
-			if(strcmp(item->text, pop->text) == 0) {
-				char* lhs = first[idx].text;
-				first[idx].text = item->text;
-				item->text = lhs;
-				++idx;
-				break;
-			}
+	const struct popent *a = *(struct popent **)lhs, *b = *(struct popent **)rhs;
+	double sa = popscore[a - popents], sb = popscore[b - popents];
+
+	if (sa != sb)
+		return sa < sb ? 1 : -1;
+	return a < b ? -1 : a > b;
+}
+
+/* count of ent decayed to now, halving every halflife days */
+static double
+popdecay(const struct popent *ent, time_t now)
+{
+	if (!halflife || ent->last >= now)
+		return ent->count;
+	return ent->count * exp2(-(double)(now - ent->last) / (halflife * 86400.0));
+}
+
+static uint32_t
+hashtext(const char *s, size_t len)
+{
+	uint64_t h = len * 0x9E3779B97F4A7C15ULL, w;
+
+	for (; len >= sizeof w; s += sizeof w, len -= sizeof w) {
+		memcpy(&w, s, sizeof w);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	for (w = 0; len; len--)
+		w = w << 8 | (unsigned char)s[len - 1];
+	h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+	return h ^ h >> 32;
+}
+
+/* rank of text of len bytes in the popularity database, 0 if not in it */
+static uint32_t
+poplookup(const char *text, size_t len)
+{
+	uint32_t i, h;
+
+	if (!npop)
+		return 0;
+	h = hashtext(text, len);
+	for (i = h & (pophashsize - 1); pophash[i].rank; i = (i + 1) & (pophashsize - 1))
+		if (pophash[i].hash == h && !strcmp(text, popstr + poprank[pophash[i].rank - 1]->off))
+			return pophash[i].rank;
+	return 0;
+}
+
+/* map the database open at fd in place of the current one, -1 if it
+ * is not usable */
+static int
+mappop(int fd)
+{
+	const struct pophdr *hdr;
+	const char *text;
+	struct stat st;
+	uint32_t i, r, h;
+	time_t now;
+
+	if (popmap)
+		munmap(popmap, popmapsize);
+	popmap = NULL;
+	npop = 0;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof *hdr ||
+	    (popmap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		popmap = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	popmapsize = st.st_size;
+
+	/* ignore a database which is not consistent, it gets replaced */
+	hdr = (struct pophdr *)popmap;
+	if (memcmp(hdr->magic, POPMAGIC, sizeof hdr->magic) || hdr->version != POPVERSION ||
+	    hdr->n > (popmapsize - sizeof *hdr) / sizeof(struct popent) ||
+	    popmapsize - sizeof *hdr - hdr->n * sizeof(struct popent) != hdr->strsize ||
+	    (hdr->strsize && popmap[popmapsize - 1] != '\0'))
+		return -1;
+	popents = (struct popent *)(popmap + sizeof *hdr);
+	popstr = (const char *)(popents + hdr->n);
+	for (i = 0; i < hdr->n; i++)
+		if (popents[i].off >= hdr->strsize ||
+		    !isfinite(popents[i].count) || popents[i].count < 0)
+			return -1;
+	npop = hdr->n;
+
+	if (!(poprank = realloc(poprank, npop * sizeof *poprank + 1)) ||
+	    !(popscore = realloc(popscore, npop * sizeof *popscore + 1)))
+		die("realloc:");
+	now = time(NULL);
+	for (i = 0; i < npop; i++) {
+		poprank[i] = &popents[i];
+		popscore[i] = popdecay(&popents[i], now);
+	}
+	qsort(poprank, npop, sizeof *poprank, comparepopbyscorerev);
+
+	/* index the ranks by text, at most half full */
+	for (pophashsize = 64; pophashsize < 2 * npop; pophashsize *= 2)
+		;
+	free(pophash);
+	pophash = ecalloc(pophashsize, sizeof *pophash);
+	for (r = 1; r <= npop; r++) {
+		text = popstr + poprank[r - 1]->off;
+		h = hashtext(text, strlen(text));
+		for (i = h & (pophashsize - 1); pophash[i].rank; i = (i + 1) & (pophashsize - 1))
+			;
+		pophash[i].hash = h;
+		pophash[i].rank = r;
+	}
+	return 0;
+}
+
+/* find the entry for text, or where it would be inserted */
+static int
+popfind(const char *text, uint32_t *pos)
+{
+	uint32_t lo = 0, hi = npop, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (!(cmp = strcmp(text, popstr + popents[mid].off))) {
+			*pos = mid;
+			return 1;
 		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*pos = lo;
+	return 0;
+}
+
+/* write n entries, sorted by text, to a new database replacing the old */
+static int
+popwrite(const char **texts, struct popent *ents, uint32_t n)
+{
+	struct pophdr hdr = { POPMAGIC, POPVERSION, n, 0 };
+	char *tmp;
+	FILE *fp;
+	uint32_t i, off;
+	int fd;
+
+	for (i = 0; i < n; i++)
+		hdr.strsize += strlen(texts[i]) + 1;
+	if (!(tmp = malloc(strlen(popdb) + sizeof ".XXXXXX")))
+		die("malloc:");
+	sprintf(tmp, "%s.XXXXXX", popdb);
+	if ((fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w"))) {
+		if (fd >= 0)
+			close(fd);
+		free(tmp);
+		return -1;
+	}
+	fwrite(&hdr, sizeof hdr, 1, fp);
+	for (off = 0, i = 0; i < n; off += strlen(texts[i++]) + 1)
+		ents[i].off = off;
+	fwrite(ents, sizeof *ents, n, fp);
+	for (i = 0; i < n; i++)
+		fwrite(texts[i], strlen(texts[i]) + 1, 1, fp);
+	if (ferror(fp) | (fclose(fp) == EOF) || rename(tmp, popdb) < 0) {
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* serialize database updates of concurrent instances, returns the lock fd */
+static int
+lockpop(void)
+{
+	char *path;
+	int fd;
+
+	if (!(path = malloc(strlen(popdb) + sizeof ".lock")))
+		die("malloc:");
+	sprintf(path, "%s.lock", popdb);
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) >= 0 && flock(fd, LOCK_EX) < 0) {
+		close(fd);
+		fd = -1;
 	}
+	if (fd < 0)
+		fprintf(stderr, "dmenu: cannot lock %s\n", path);
+	free(path);
+	return fd;
 }
 
+/* ranks index the mapping they were looked up in, redo them after a remap */
 static void
-incpop(struct item* sel) {
-	if(!(sel && sel->text))
+rankitems(void)
+{
+	size_t i;
+
+	for (i = 0; i < nitems; i++)
+		items[i].rank = poplookup(items[i].text, items[i].len);
+}
+
+static void
+incpop(struct item *sel)
+{
+	const char **texts;
+	struct popent *ents, ent;
+	unsigned char *drop;
+	uint32_t i, n, pos;
+	time_t now = time(NULL);
+	int fd, lock;
+
+	if (!sel || !popdb || (lock = lockpop()) < 0)
 		return;
-	struct item* pop = NULL;
-	int found = 0;
-	FILE *out;
-	out = fopen(popcache, "w");
-	if (out == NULL) {
-		printf("Cannot open file '%s'", popcache);
+	/* another instance may have replaced the database since we mapped it */
+	if ((fd = open(popdb, O_RDONLY)) >= 0)
+		mappop(fd);
+	if (popfind(sel->text, &pos)) {
+		/* known text: decay its count and bump it in place */
+		ent = popents[pos];
+		ent.count = popdecay(&ent, now) + 1;
+		ent.last = MAX(ent.last, now);
+		if ((fd = open(popdb, O_WRONLY)) >= 0) {
+			if (pwrite(fd, &ent, sizeof ent, sizeof(struct pophdr) +
+			           pos * sizeof(struct popent)) != sizeof ent)
+				fprintf(stderr, "dmenu: cannot update %s\n", popdb);
+			close(fd);
+		}
+		close(lock);
+		rankitems();
 		return;
 	}
-	char decimal[16] = {'\0'};
-	for (pop = popitems; pop && pop->text; ++pop) {
-		if(found == 0 && strcmp(pop->text, sel->text) == 0) {
-			pop->out += 1;
-			found = 1;
+	/* new text: rewrite the database with it inserted at pos.  Once there
+	 * are popmax entries the lowest scored tenth is dropped, which leaves
+	 * room for new texts to be chosen again before they are dropped. */
+	if (!(texts = malloc((npop + 1) * sizeof *texts)) ||
+	    !(ents = malloc((npop + 1) * sizeof *ents)))
+		die("malloc:");
+	drop = ecalloc(npop + 1, 1);
+	for (i = popmax && npop >= popmax ? popmax * 9 / 10 : npop; i < npop; i++)
+		drop[poprank[i] - popents] = 1;
+	for (n = i = 0; i <= npop; i++) {
+		if (i == pos) {
+			texts[n] = sel->text;
+			ents[n].last = now;
+			ents[n++].count = 1;
+		}
+		if (i < npop && !drop[i]) {
+			texts[n] = popstr + popents[i].off;
+			ents[n++] = popents[i];
+		}
+	}
+	if (popwrite(texts, ents, n) < 0)
+		fprintf(stderr, "dmenu: cannot write %s\n", popdb);
+	free(texts);
+	free(ents);
+	free(drop);
+	/* pick up the new database for further selections */
+	if ((fd = open(popdb, O_RDONLY)) >= 0)
+		mappop(fd);
+	close(lock);
+	rankitems();
+}
+
+/* keep the n results in mkeys for narrowing them down later */
+static void
+pushset(size_t n)
+{
+	struct matchset tmp, *set;
+	size_t j;
+
+	/* the empty query matches everything, no point in keeping it */
+	if (!*text)
+		return;
+	if (nsets == MATCHSETS) {
+		/* forget the oldest set, recycling its buffers */
+		tmp = sets[0];
+		memmove(sets, sets + 1, (MATCHSETS - 1) * sizeof *sets);
+		sets[--nsets] = tmp;
+	}
+	set = &sets[nsets++];
+	free(set->text);
+	if (!(set->text = strdup(text)))
+		die("strdup:");
+	if (n > set->size) {
+		set->size = n;
+		if (!(set->items = realloc(set->items, set->size * sizeof *set->items)))
+			die("cannot realloc %zu bytes:", set->size * sizeof *set->items);
+	}
+	for (j = 0; j < n; j++)
+		set->items[j] = &items[(uint32_t)mkeys[j]];
+	set->n = n;
+	set->nitems = mnitems;
+}
+
+/* candidate j of a scan: cached results first, then the items from mtail */
+static struct item *
+candidate(size_t j)
+{
+	return j < mcandn ? mcand[j] : &items[mtail + j - mcandn];
+}
+
+static int
+charclass(unsigned char c)
+{
+	if (c == ' ' || c == '\t')
+		return CharWhite;
+	if (c == '/' || c == ',' || c == ':' || c == ';' || c == '|')
+		return CharDelim;
+	if ((c >= 'a' && c <= 'z') || c >= 128)
+		return CharLower;
+	if (c >= 'A' && c <= 'Z')
+		return CharUpper;
+	if (c >= '0' && c <= '9')
+		return CharDigit;
+	return CharNonWord;
+}
+
+/* bonus of matching the character at i of item */
+static int
+fuzzybonus(struct item *item, size_t i)
+{
+	int prev = i ? charclass(item->text[i - 1]) : CharWhite;
+	int cur = charclass(item->text[i]);
+
+	if (cur >= CharLower) {
+		if (prev == CharWhite)
+			return 10;
+		if (prev == CharDelim)
+			return 9;
+		if (prev == CharNonWord)
+			return 8;
+	}
+	if ((prev == CharLower && cur == CharUpper) || (prev != CharDigit && cur == CharDigit))
+		return 7; /* camelCase and foo123 */
+	if (cur == CharWhite)
+		return 10;
+	return cur < CharLower ? 8 : 0;
+}
+
+/* best score of the m characters of tok as a subsequence of item, or
+ * FUZZYNONE, computed row by row for each character of tok */
+static int
+fuzzytoken(struct item *item, const char *tok, size_t m, struct matchjob *job)
+{
+	const char *s = item->ftext;
+	size_t start = 0, end, i, j, n, lo;
+	int *row, *run, best, bonus, fb, s1, s2, g0, gg, r0, old, oldr;
+
+	/* the first match of tok[0] and the last of its final character
+	 * bound the part of the text that needs to be scored */
+	for (i = j = 0; j < item->len && i < m; j++)
+		if (s[j] == tok[i] && !i++)
+			start = j;
+	if (i < m)
+		return FUZZYNONE;
+	for (end = item->len; s[end - 1] != tok[m - 1]; end--)
+		;
+	s += start;
+	n = end - start;
+	if (2 * n > job->rowsize) {
+		job->rowsize = 2 * n;
+		if (!(job->row = realloc(job->row, job->rowsize * sizeof *job->row)))
+			die("cannot realloc %zu bytes:", job->rowsize * sizeof *job->row);
+	}
+	/* row holds the best scores of tok[i] matched at j, run the bonus of
+	 * the first character of the run of matches j ends */
+	row = job->row;
+	run = row + n;
+	for (j = 0; j < n; j++) {
+		if (s[j] == tok[0]) {
+			run[j] = fuzzybonus(item, start + j);
+			/* the first character counts twice */
+			row[j] = FUZZYMATCH + 2 * run[j];
+		} else {
+			row[j] = FUZZYNONE;
+		}
+	}
+	for (i = 1, lo = 0; i < m; i++) {
+		/* best score of the previous character right before j, and
+		 * before that with the gap penalty */
+		g0 = gg = FUZZYNONE;
+		r0 = 0;
+		for (j = lo; j < n; j++) {
+			old = row[j];
+			oldr = run[j];
+			if (s[j] == tok[i]) {
+				bonus = fuzzybonus(item, start + j);
+				/* a run keeps the bonus of its start, unless a
+				 * boundary inside it is worth more */
+				fb = bonus >= 8 && bonus > r0 ? bonus : r0;
+				s1 = g0 + FUZZYMATCH + MAX(MAX(bonus, fb), FUZZYCONSEC);
+				s2 = gg + FUZZYMATCH + bonus;
+				row[j] = MAX(s1, s2);
+				run[j] = s1 >= s2 ? fb : bonus;
+			} else {
+				row[j] = FUZZYNONE;
+			}
+			gg = MAX(gg + FUZZYGAPEXT, g0 + FUZZYGAPSTART);
+			g0 = old;
+			r0 = oldr;
+		}
+		/* tok[i] cannot be matched before its first match after the
+		 * first one of tok[i - 1], everything before stays FUZZYNONE */
+		for (lo++; s[lo] != tok[i]; lo++)
+			;
+	}
+	for (best = FUZZYNONE, j = 0; j < n; j++)
+		best = MAX(best, row[j]);
+	return best;
+}
+
+/* 0 if item does not match the tokens with -F, else higher scores first */
+static unsigned int
+fuzzymatch(struct item *item, struct matchjob *job)
+{
+	int i, score, sum = 0;
+
+	if (!mtokc)
+		return 1;
+	for (i = 0; i < mtokc; i++) {
+		if ((score = fuzzytoken(item, mtokv[i], strlen(mtokv[i]), job)) == FUZZYNONE)
+			return 0;
+		sum += score;
+	}
+	/* 1 is left to the empty query, which matches everything alike */
+	return 0xFFFF - MIN(MAX(sum, 0), 0xFFFD);
+}
+
+static void *
+matchrange(void *arg)
+{
+	struct matchjob *job = arg;
+	struct item *item;
+	size_t j;
+	int i;
+
+	for (j = job->lo; j < job->hi; j++) {
+		item = candidate(j);
+		/* too short to contain the longest token, or a character of
+		 * the tokens is missing */
+		if (item->len < mtokmax || mtokmask & ~item->mask) {
+			mres[j] = 0;
+			continue;
+		}
+		if (fuzzy) {
+			mres[j] = fuzzymatch(item, job);
+			continue;
 		}
-		fputs(pop->text, out);
-		fputs(" ", out);
-		sprintf(decimal, "%i", MIN(pop->out, 999));
-		fputs(decimal, out);
-		fputs("\n", out);
+		for (i = 0; i < mtokc; i++)
+			if (!strstr(item->ftext, mtokv[i]))
+				break;
+		mres[j] = i == mtokc ? matchclass(item) : 0;
+	}
+	return NULL;
+}
+
+static void
+matchall(size_t lo, size_t hi)
+{
+	static size_t ressize = 0;
+
+	pthread_t tid[64];
+	int started[64];
+	size_t i, nthreads;
+
+	if (hi > ressize) {
+		ressize = hi;
+		if (!(mres = realloc(mres, ressize * sizeof *mres)))
+			die("cannot realloc %zu bytes:", ressize * sizeof *mres);
 	}
-	if(found == 0) {
-		fputs(sel->text, out);
-		fputs(" 1", out);
-		fputs("\n", out);
+	/* split the candidates into contiguous chunks, one per thread */
+	nthreads = MIN(MIN(jobs, LENGTH(mjob)), (hi - lo) / MATCHCHUNK);
+	if (nthreads < 2) {
+		mjob[0].lo = lo;
+		mjob[0].hi = hi;
+		matchrange(&mjob[0]);
+		return;
+	}
+	for (i = 0; i < nthreads; i++) {
+		mjob[i].lo = lo + (hi - lo) * i / nthreads;
+		mjob[i].hi = lo + (hi - lo) * (i + 1) / nthreads;
+		/* the first chunk is matched by the calling thread */
+		started[i] = i && !pthread_create(&tid[i], NULL, matchrange, &mjob[i]);
 	}
-	fclose(out);
+	for (i = 0; i < nthreads; i++)
+		if (!started[i])
+			matchrange(&mjob[i]);
+	for (i = 1; i < nthreads; i++)
+		if (started[i])
+			pthread_join(tid[i], NULL);
 }
 
 static void
-match(void)
+growkeys(size_t n)
+{
+	static size_t size = 0;
+
+	if (n >= size) {
+		size = n + 1;
+		if (!(mkeys = realloc(mkeys, size * sizeof *mkeys)))
+			die("cannot realloc %zu bytes:", size * sizeof *mkeys);
+	}
+}
+
+/* match the items read since the lists were built and merge them in by
+ * their keys: those sorting before the unsorted rest are linked in place,
+ * the others join the rest */
+static void
+matchnew(size_t from)
+{
+	uint64_t *v;
+	size_t i, j, k, d, m, n = nitems - from, r = mkeysn - mhead;
+	int top = (sel == matches && curr == matches);
+
+	if (!n)
+		return;
+	mcandn = 0;
+	mtail = from;
+	matchall(0, n);
+	growkeys(mkeysn + n);
+	v = mkeys + mkeysn;
+	for (j = k = 0; j < n; j++)
+		if (mres[j])
+			v[k++] = itemkey(candidate(j), mres[j]);
+	if (!k)
+		return;
+	qsort(v, k, sizeof *v, comparekey);
+	for (m = 0; m < k && (!r || v[m] < mkeys[mhead - 1]); m++)
+		;
+	if (m) {
+		if (!(v = malloc(m * sizeof *v)))
+			die("cannot malloc %zu bytes:", m * sizeof *v);
+		memcpy(v, mkeys + mkeysn, m * sizeof *v);
+		/* the rest has no order, make room by moving its first keys last */
+		memmove(mkeys + mkeysn + m - MIN(m, r), mkeys + mhead, MIN(m, r) * sizeof *v);
+		for (i = mhead, j = m, d = mhead + m; j > 0; )
+			mkeys[--d] = i && mkeys[i - 1] > v[j - 1] ? mkeys[--i] : v[--j];
+		free(v);
+		mhead += m;
+		matches = matchend = NULL;
+		for (j = 0; j < mhead; j++)
+			appenditem(&items[(uint32_t)mkeys[j]], &matches, &matchend);
+	}
+	mkeysn += k;
+	if (top)
+		curr = sel = matches;
+	calcoffsets();
+	dirty |= DirtyList;
+}
+
+/* start matching text, the candidates are then scanned by matchstep() */
+static void
+matchbegin(void)
 {
-	static char **tokv = NULL;
 	static int tokn = 0;
 
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t textsize;
-	struct item *item, *others, *othersend;
+	char *s;
+	int tokc = 0;
+	size_t j, len;
+	struct matchset *set = NULL;
 
-	strcpy(buf, text);
+	for (mtextlen = 0; text[mtextlen]; mtextlen++)
+		mtext[mtextlen] = fold ? foldtab[(unsigned char)text[mtextlen]] : text[mtextlen];
+	mtext[mtextlen] = '\0';
+	strcpy(mtokbuf, mtext);
 	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-			die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
-
-	matches = others = matchend = othersend = NULL;
-	textsize = strlen(text) + 1;
-	for (item = items; item && item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
-				break;
-		if (i != tokc) /* not all tokens match */
-			continue;
-		/* exact matches go first, then others */
-		if (!tokc || !fstrncmp(text, item->text, textsize))
-			appenditem(item, &matches, &matchend);
-		else
-			appenditem(item, &others, &othersend);
+	mtokmax = 0;
+	for (mtokmask = 0, s = mtext; *s; s++)
+		if (*s != ' ')
+			mtokmask |= charbits[(unsigned char)*s];
+	for (s = strtok(mtokbuf, " "); s; mtokv[tokc - 1] = s, s = strtok(NULL, " ")) {
+		if (++tokc > tokn && !(mtokv = realloc(mtokv, ++tokn * sizeof *mtokv)))
+			die("cannot realloc %zu bytes:", tokn * sizeof *mtokv);
+		if ((len = strlen(s)) > mtokmax)
+			mtokmax = len;
 	}
-	if (others) {
-		sortitemsbypop(others, othersend);
-		if (matches) {
-			matchend->right = others;
-			others->left = matchend;
-		} else
-			matches = others;
-		matchend = othersend;
+	mtokc = tokc;
+
+	/* drop result sets of queries which the new text does not extend */
+	while (nsets > 0 && strncmp(text, sets[nsets - 1].text, strlen(sets[nsets - 1].text)))
+		nsets--;
+	if (nsets > 0) {
+		set = &sets[nsets - 1];
+		if (!strcmp(text, set->text)) {
+			/* same query as before, e.g. after BackSpace: reuse results */
+			growkeys(set->n);
+			if (fuzzy) {
+				/* their scores are not kept */
+				mcand = set->items;
+				mcandn = set->n;
+				mtail = nitems;
+				matchall(0, set->n);
+			}
+			for (j = 0; j < set->n; j++)
+				mkeys[j] = itemkey(set->items[j], fuzzy ? mres[j] : matchclass(set->items[j]));
+			linkresults(set->n);
+			curr = sel = matches;
+			calcoffsets();
+			dirty |= DirtyList;
+			matchnew(set->nitems);
+			scanning = 0;
+			return;
+		}
 	}
+	/* if the query only grew, just filter the previous results and
+	 * whatever was read since */
+	mcand = set ? set->items : NULL;
+	mcandn = set ? set->n : 0;
+	mtail = set ? set->nitems : 0;
+	mn = mcandn + nitems - mtail;
+	mdone = 0;
+	mnitems = nitems;
+	scanning = 1;
+}
+
+/* scan up to count more candidates, the lists are only rebuilt once the
+ * scan is complete so it can be abandoned for newer text at any point */
+static void
+matchstep(size_t count)
+{
+	size_t j, n, hi = mn - mdone > count ? mdone + count : mn;
+
+	matchall(mdone, hi);
+	if ((mdone = hi) < mn)
+		return;
+	scanning = 0;
+
+	growkeys(mn);
+	for (j = n = 0; j < mn; j++)
+		if (mres[j])
+			mkeys[n++] = itemkey(candidate(j), mres[j]);
+	/* in candidate order, which is the one cheapest to narrow down */
+	pushset(n);
+	linkresults(n);
 	curr = sel = matches;
 	calcoffsets();
+	dirty |= DirtyList;
+	/* add the items read in the background while scanning */
+	if (nitems > mnitems)
+		matchnew(mnitems);
+}
+
+static void
+match(void)
+{
+	matchbegin();
+	if (scanning)
+		matchstep(-1);
+}
+
+/* bring the matches up to date before looking at them */
+static void
+flushmatch(void)
+{
+	if (dirty & DirtyMatch || timers[TimerMatch]) {
+		dirty &= ~DirtyMatch;
+		timers[TimerMatch] = 0;
+		match();
+	} else if (scanning) {
+		matchstep(-1);
+	}
 }
 
 static void
@@ -339,7 +1146,7 @@ insert(const char *str, ssize_t n)
 	if (n > 0)
 		memcpy(&text[cursor], str, n);
 	cursor += n;
-	match();
+	dirty |= DirtyMatch;
 }
 
 static size_t
@@ -408,7 +1215,7 @@ keypress(XKeyEvent *ev)
 
 		case XK_k: /* delete right */
 			text[cursor] = '\0';
-			match();
+			dirty |= DirtyMatch;
 			break;
 		case XK_u: /* delete left */
 			insert(NULL, 0 - cursor);
@@ -479,10 +1286,12 @@ insert:
 		break;
 	case XK_End:
 	case XK_KP_End:
+		flushmatch();
 		if (text[cursor] != '\0') {
 			cursor = strlen(text);
 			break;
 		}
+		sortrest();
 		if (next) {
 			/* jump to end of list and position items in reverse */
 			curr = matchend;
@@ -499,6 +1308,7 @@ insert:
 		exit(1);
 	case XK_Home:
 	case XK_KP_Home:
+		flushmatch();
 		if (sel == matches) {
 			cursor = 0;
 			break;
@@ -508,6 +1318,7 @@ insert:
 		break;
 	case XK_Left:
 	case XK_KP_Left:
+		flushmatch();
 		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
@@ -517,6 +1328,7 @@ insert:
 		/* fallthrough */
 	case XK_Up:
 	case XK_KP_Up:
+		flushmatch();
 		if (sel && sel->left && (sel = sel->left)->right == curr) {
 			curr = prev;
 			calcoffsets();
@@ -524,6 +1336,7 @@ insert:
 		break;
 	case XK_Next:
 	case XK_KP_Next:
+		flushmatch();
 		if (!next)
 			return;
 		sel = curr = next;
@@ -531,6 +1344,7 @@ insert:
 		break;
 	case XK_Prior:
 	case XK_KP_Prior:
+		flushmatch();
 		if (!prev)
 			return;
 		sel = curr = prev;
@@ -538,17 +1352,25 @@ insert:
 		break;
 	case XK_Return:
 	case XK_KP_Enter:
-		incpop(sel);
+		flushmatch();
 		puts((sel && !(ev->state & ShiftMask)) ? sel->text : text);
+		/* hand out the choice before touching the popularity database */
+		fflush(stdout);
 		if (!(ev->state & ControlMask)) {
+			fclose(stdout);
+			incpop(sel);
 			cleanup();
 			exit(0);
 		}
-		if (sel)
+		incpop(sel);
+		if (sel) {
 			sel->out = 1;
+			dirty |= DirtyList;
+		}
 		break;
 	case XK_Right:
 	case XK_KP_Right:
+		flushmatch();
 		if (text[cursor] != '\0') {
 			cursor = nextrune(+1);
 			break;
@@ -558,23 +1380,25 @@ insert:
 		/* fallthrough */
 	case XK_Down:
 	case XK_KP_Down:
+		flushmatch();
 		if (sel && sel->right && (sel = sel->right) == next) {
 			curr = next;
 			calcoffsets();
 		}
 		break;
 	case XK_Tab:
+		flushmatch();
 		if (!sel)
 			return;
 		cursor = strnlen(sel->text, sizeof text - 1);
 		memcpy(text, sel->text, cursor);
 		text[cursor] = '\0';
-		match();
+		dirty |= DirtyMatch;
 		break;
 	}
 
 draw:
-	drawmenu();
+	dirty |= DirtyDraw;
 }
 
 static void
@@ -592,70 +1416,416 @@ paste(void)
 		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
 		XFree(p);
 	}
-	drawmenu();
+	dirty |= DirtyDraw;
+}
+
+static struct item *
+moved(struct item *item, struct item *old)
+{
+	return item ? items + (item - old) : NULL;
+}
+
+/* point everything that referred to the old item array at the new one */
+static void
+rebase(struct item *old)
+{
+	size_t i;
+	int j;
+
+	for (i = 0; i < nitems; i++) {
+		items[i].left = moved(items[i].left, old);
+		items[i].right = moved(items[i].right, old);
+	}
+	for (j = 0; j < nsets; j++)
+		for (i = 0; i < sets[j].n; i++)
+			sets[j].items[i] = moved(sets[j].items[i], old);
+	matches = moved(matches, old);
+	matchend = moved(matchend, old);
+	prev = moved(prev, old);
+	curr = moved(curr, old);
+	next = moved(next, old);
+	sel = moved(sel, old);
+}
+
+static void
+additem(char *str, size_t len)
+{
+	static size_t itemsiz = 0;
+	struct item *item, *old;
+	uint64_t mask;
+	size_t i;
+
+	if (nitems + 1 >= itemsiz) {
+		itemsiz = itemsiz ? itemsiz * 2 : 4096;
+		old = items;
+		if (!(items = malloc(itemsiz * sizeof(*items))))
+			die("cannot malloc %zu bytes:", itemsiz * sizeof(*items));
+		if (old) {
+			memcpy(items, old, (nitems + 1) * sizeof(*items));
+			rebase(old);
+			free(old);
+		}
+	}
+	item = &items[nitems];
+	item->text = item->ftext = str;
+	item->left = item->right = NULL;
+	item->len = len;
+	item->w = item->wmax = 0;
+	item->rank = poplookup(str, len);
+	item->out = 0;
+	if (fold) {
+		/* the folded copy lives at the same offset in the twin chunk */
+		item->ftext = fchunk + (str - chunk);
+		for (i = 0; i <= len; i++)
+			item->ftext[i] = foldtab[(unsigned char)str[i]];
+	}
+	/* letters of either case share a bit, so this holds for ftext too */
+	for (i = 0, mask = 0; i < len; i++)
+		mask |= charbits[(unsigned char)str[i]];
+	item->mask = mask;
+	items[++nitems].text = NULL;
+}
+
+static void
+newchunk(size_t size)
+{
+	size_t partial = chunklen - linestart;
+	char *p;
+
+	/* the unterminated line at the end of the old chunk moves along */
+	size = MAX(size, 2 * partial + 2);
+	if (!(chunks = realloc(chunks, (nchunks + 2) * sizeof(*chunks))))
+		die("cannot realloc %zu bytes:", (nchunks + 2) * sizeof(*chunks));
+	if (!(p = malloc(size)))
+		die("cannot malloc %zu bytes:", size);
+	if (partial)
+		memcpy(p, chunk + linestart, partial);
+	chunks[nchunks++] = chunk = p;
+	if (fold && !(chunks[nchunks++] = fchunk = malloc(size)))
+		die("cannot malloc %zu bytes:", size);
+	chunksize = size;
+	chunklen = partial;
+	linestart = 0;
+}
+
+/* read what is available on stdin and add the complete lines to the
+ * items, returns 0 at the end of the input */
+static int
+readchunk(void)
+{
+	struct stat st;
+	char *p, *nl;
+	ssize_t n;
+
+	if (!chunk) {
+		/* a regular file is read into a single chunk */
+		if (!fstat(0, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+			newchunk(st.st_size + 2);
+		else
+			newchunk(CHUNKMIN);
+	}
+	if (chunklen + 1 >= chunksize)
+		newchunk(MIN(chunksize * 2, CHUNKMAX));
+	/* keep a byte free to terminate a last line without newline */
+	if ((n = read(0, chunk + chunklen, chunksize - chunklen - 1)) < 0 && errno == EINTR)
+		return 1;
+	if (n <= 0) {
+		if (linestart < chunklen) {
+			chunk[chunklen] = '\0';
+			additem(chunk + linestart, chunklen - linestart);
+			linestart = chunklen;
+		}
+		return 0;
+	}
+	/* terminate the new lines in place */
+	for (p = chunk + chunklen, chunklen += n;
+	     (nl = memchr(p, '\n', chunk + chunklen - p)); p = nl + 1) {
+		*nl = '\0';
+		additem(chunk + linestart, nl - chunk - linestart);
+		linestart = nl + 1 - chunk;
+	}
+	return 1;
 }
 
 static void
 readstdin(void)
 {
-	char *line = NULL;
-	size_t i, itemsiz = 0, linesiz = 0;
-	ssize_t len;
+	while (readchunk())
+		;
+	lines = MIN(lines, nitems);
+}
+
+static int
+comparestr(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; (len = getline(&line, &linesiz, stdin)) != -1; i++) {
-		if (i + 1 >= itemsiz) {
-			itemsiz += 256;
-			if (!(items = realloc(items, itemsiz * sizeof(*items))))
-				die("cannot realloc %zu bytes:", itemsiz * sizeof(*items));
+/* lists the executables in $PATH once each, sorted, one per line like
+ * dmenu_path does */
+static char *
+scanpath(size_t *len)
+{
+	const char *env = getenv("PATH");
+	char *path, *dir, *names = NULL, **v, *buf;
+	size_t n = 0, size = 0, nv = 0, i, l;
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+
+	if (!(path = strdup(env ? env : "")))
+		die("strdup:");
+	for (dir = strtok(path, ":"); dir; dir = strtok(NULL, ":")) {
+		if (!(dp = opendir(dir)))
+			continue;
+		while ((d = readdir(dp))) {
+			if (d->d_name[0] == '.' ||
+			    fstatat(dirfd(dp), d->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode) ||
+			    faccessat(dirfd(dp), d->d_name, X_OK, 0) < 0)
+				continue;
+			l = strlen(d->d_name) + 1;
+			if (n + l > size && !(names = realloc(names, size = MAX(2 * size, n + l + 4096))))
+				die("cannot realloc %zu bytes:", size);
+			memcpy(names + n, d->d_name, l);
+			n += l;
+			nv++;
 		}
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
-		if (!(items[i].text = strdup(line)))
+		closedir(dp);
+	}
+	free(path);
+
+	if (!(v = malloc((nv + 1) * sizeof(*v))) || !(buf = malloc(n + 1)))
+		die("malloc:");
+	for (i = 0, l = 0; i < nv; l += strlen(names + l) + 1)
+		v[i++] = names + l;
+	qsort(v, nv, sizeof(*v), comparestr);
+	for (*len = 0, i = 0; i < nv; i++) {
+		if (i && !strcmp(v[i], v[i - 1]))
+			continue;
+		l = strlen(v[i]);
+		memcpy(buf + *len, v[i], l);
+		buf[*len + l] = '\n';
+		*len += l + 1;
+	}
+	free(names);
+	free(v);
+	return buf;
+}
+
+/* replaces the cache at once, quietly giving up as it is only a cache */
+static void
+writepath(const char *cache, const char *buf, size_t len)
+{
+	char *tmp;
+	int fd;
+
+	if (!(tmp = malloc(strlen(cache) + sizeof ".XXXXXX")))
+		die("malloc:");
+	sprintf(tmp, "%s.XXXXXX", cache);
+	if ((fd = mkstemp(tmp)) >= 0 &&
+	    ((write(fd, buf, len) != (ssize_t)len) | (close(fd) < 0) || rename(tmp, cache) < 0))
+		unlink(tmp);
+	free(tmp);
+}
+
+/* the executables in $PATH become the items, read from the cache shared with
+ * dmenu_path as long as no directory in $PATH is newer than it */
+static void
+readpath(void)
+{
+	const char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	char *cache = NULL, *path, *buf = MAP_FAILED, *p, *nl;
+	struct stat st, dst;
+	size_t len = 0;
+	int fd = -1, stale;
+
+	if (dir && *dir)
+		len = strlen(dir) + sizeof "/dmenu_run";
+	else if (home)
+		len = strlen(home) + sizeof "/.cache/dmenu_run";
+	if (len) {
+		if (!(cache = malloc(len)))
+			die("malloc:");
+		snprintf(cache, len, dir && *dir ? "%s/dmenu_run" : "%s/.cache/dmenu_run",
+		         dir && *dir ? dir : home);
+	}
+
+	stale = !cache || (fd = open(cache, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || !st.st_size;
+	if (!stale) {
+		if (!(path = strdup(getenv("PATH") ? getenv("PATH") : "")))
 			die("strdup:");
+		for (dir = strtok(path, ":"); dir && !stale; dir = strtok(NULL, ":"))
+			stale = !stat(dir, &dst) && S_ISDIR(dst.st_mode) &&
+			        !access(dir, R_OK) && dst.st_mtime > st.st_mtime;
+		free(path);
+	}
+	/* a private mapping lets the lines be terminated in place */
+	if (!stale && (buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	                          fd, 0)) != MAP_FAILED && buf[st.st_size - 1] == '\n') {
+		pathmap = buf;
+		pathmapsize = len = st.st_size;
+	} else {
+		if (buf != MAP_FAILED)
+			munmap(buf, st.st_size);
+		buf = scanpath(&len);
+		if (!(chunks = realloc(chunks, (nchunks + 1) * sizeof(*chunks))))
+			die("cannot realloc %zu bytes:", (nchunks + 1) * sizeof(*chunks));
+		chunks[nchunks++] = buf;
+		if (cache)
+			writepath(cache, buf, len);
+	}
+	if (fd >= 0)
+		close(fd);
+	free(cache);
 
-		items[i].out = 0;
+	chunk = buf;
+	if (fold) {
+		if (!(chunks = realloc(chunks, (nchunks + 1) * sizeof(*chunks))))
+			die("cannot realloc %zu bytes:", (nchunks + 1) * sizeof(*chunks));
+		if (!(chunks[nchunks++] = fchunk = malloc(len + 1)))
+			die("cannot malloc %zu bytes:", len + 1);
+	}
+	for (p = buf; (nl = memchr(p, '\n', buf + len - p)); p = nl + 1) {
+		*nl = '\0';
+		additem(p, nl - p);
+	}
+	lines = MIN(lines, nitems);
+}
+
+static long long
+timems(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void
+handle(XEvent *ev)
+{
+	if (XFilterEvent(ev, win))
+		return;
+	switch(ev->type) {
+	case DestroyNotify:
+		if (ev->xdestroywindow.window != win)
+			break;
+		cleanup();
+		exit(1);
+	case Expose:
+		if (ev->xexpose.count == 0)
+			drw_map(drw, win, 0, 0, mw, mh);
+		break;
+	case FocusIn:
+		/* regrab focus from parent window */
+		if (ev->xfocus.window != win)
+			grabfocus();
+		break;
+	case KeyPress:
+#ifdef STATS
+		if (!statstime) {
+			statsreq = NextRequest(dpy);
+			statstime = timems();
+		}
+#endif
+		keypress(&ev->xkey);
+		break;
+	case SelectionNotify:
+		if (ev->xselection.property == utf8)
+			paste();
+		break;
+	case VisibilityNotify:
+		if (ev->xvisibility.state != VisibilityUnobscured)
+			XRaiseWindow(dpy, win);
+		break;
 	}
-	free(line);
-	if (items)
-		items[i].text = NULL;
-	lines = MIN(lines, i);
 }
 
 static void
 run(void)
 {
 	XEvent ev;
+	struct pollfd pfd[] = {
+		{ .fd = ConnectionNumber(dpy), .events = POLLIN },
+		{ .fd = 0, .events = POLLIN },
+	};
+	long long now, lastdraw = 0;
+	int i, timeout;
+	size_t from;
+
+	for (;;) {
+		while (XPending(dpy)) {
+			XNextEvent(dpy, &ev);
+			handle(&ev);
+		}
+		/* a burst of events costs a single match and redraw */
+		if (dirty & DirtyMatch) {
+			/* start over, abandoning any scan for older text */
+			dirty &= ~DirtyMatch;
+			scanning = 0;
+			if (debounce)
+				timers[TimerMatch] = timems() + debounce;
+			else
+				matchbegin();
+		}
+		/* scan in slices to keep handling input meanwhile */
+		if (scanning) {
+			matchstep(MAX(MATCHSLICE, jobs * MATCHCHUNK));
+			if (!scanning)
+				dirty |= DirtyDraw;
+		}
+		if (dirty & DirtyDraw) {
+			dirty &= ~DirtyDraw;
+			drawmenu();
+			lastdraw = timems();
+		}
+		XFlush(dpy);
+#ifdef STATS
+		if (statstime) {
+			fprintf(stderr, "dmenu: %lu requests, %lld ms\n",
+			        NextRequest(dpy) - statsreq, timems() - statstime);
+			statstime = 0;
+		}
+#endif
 
-	while (!XNextEvent(dpy, &ev)) {
-		if (XFilterEvent(&ev, win))
-			continue;
-		switch(ev.type) {
-		case DestroyNotify:
-			if (ev.xdestroywindow.window != win)
+		timeout = scanning ? 0 : -1;
+		for (now = timems(), i = 0; i < TimerLast; i++)
+			if (timers[i] && (timeout < 0 || timers[i] - now < timeout))
+				timeout = MAX(timers[i] - now, 0);
+		/* drawing can read events into Xlib's queue, poll() misses those */
+		if (QLength(dpy))
+			timeout = 0;
+		/* stdin is only watched while reading it in the background */
+		if (poll(pfd, reading ? 2 : 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+		if (reading && pfd[1].revents) {
+			from = nitems;
+			if (!(reading = readchunk()))
+				dirty |= DirtyDraw;
+			/* a scan in progress picks new items up when done */
+			if (nitems > from && !scanning) {
+				matchnew(from);
+				/* new items are drawn at most every refreshrate ms */
+				if (!timers[TimerRefresh])
+					timers[TimerRefresh] = MAX(lastdraw + refreshrate, timems());
+			}
+		}
+		for (now = timems(), i = 0; i < TimerLast; i++) {
+			if (!timers[i] || timers[i] > now)
+				continue;
+			timers[i] = 0;
+			switch (i) {
+			case TimerRefresh:
+				dirty |= DirtyDraw;
 				break;
-			cleanup();
-			exit(1);
-		case Expose:
-			if (ev.xexpose.count == 0)
-				drw_map(drw, win, 0, 0, mw, mh);
-			break;
-		case FocusIn:
-			/* regrab focus from parent window */
-			if (ev.xfocus.window != win)
-				grabfocus();
-			break;
-		case KeyPress:
-			keypress(&ev.xkey);
-			break;
-		case SelectionNotify:
-			if (ev.xselection.property == utf8)
-				paste();
-			break;
-		case VisibilityNotify:
-			if (ev.xvisibility.state != VisibilityUnobscured)
-				XRaiseWindow(dpy, win);
-			break;
+			case TimerMatch:
+				matchbegin();
+				dirty |= DirtyDraw;
+				break;
+			}
 		}
 	}
 }
@@ -761,6 +1931,7 @@ setup(void)
 	drawmenu();
 }
 
+/* parse a line of the old dmenu_pop.txt: text, a space and its count */
 static void
 itemize(struct item* item, const char* line, const ssize_t size)
 {
@@ -795,68 +1966,95 @@ itemize(struct item* item, const char* line, const ssize_t size)
 }
 
 static int
-compareitembyoutrev(const void* lhs, const void* rhs)
+compareitembytext(const void *lhs, const void *rhs)
 {
-	return ((struct item*)rhs)->out - ((struct item*)lhs)->out;
+	return strcmp(((struct item *)lhs)->text, ((struct item *)rhs)->text);
 }
 
+/* convert the text file of earlier versions into a database at popdb */
 static void
-loadpopitems(void)
+importpop(const char *path)
 {
-	const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
-	const char* home = getenv("HOME");
-	char* cache = NULL;
-	const char* CACHE_FILENAME = "/dmenu_pop.txt";
-	if(xdg_cache_home != NULL) {
-		size_t xdglen = strlen(xdg_cache_home);
-		cache = (char*)malloc(xdglen + 1);
-		cache[xdglen] = '\0';
-		strcpy(cache, xdg_cache_home);
-	} else {
-		const char* cachefolder = "/.cache";
-		size_t hclen = strlen(home) + strlen(cachefolder) + 1;
-		cache = (char*)malloc(hclen + 1);
-		cache[hclen - 1] = '\0';
-		strcpy(cache, home);
-		strcpy(cache + strlen(home), cachefolder);
-	}
-	const size_t cache_size = strlen(cache) + strlen(CACHE_FILENAME) + 1;
-	popcache = (char*)malloc(sizeof(char) * cache_size);
-	popcache[cache_size - 1] = '\0';
-	strcpy(popcache, cache);
-	strcpy(popcache + strlen(cache), CACHE_FILENAME);
-	free(cache);
-
-	FILE * fp;
-	char * line = NULL;
-	size_t i, itemsiz = 0, linesiz = 0;
+	FILE *fp;
+	struct item *pop = NULL;
+	const char **texts;
+	struct popent *ents;
+	time_t now = time(NULL);
+	char *line = NULL;
+	size_t i, j, n = 0, popsiz = 0, linesiz = 0;
 	ssize_t len;
 
-	fp = fopen(popcache, "r");
-	if (fp == NULL)
+	if (!(fp = fopen(path, "r")))
 		return;
-
-	for (i = 0; (len = getline(&line, &linesiz, fp)) != -1; i++) {
-		if (i + 1 >= itemsiz) {
-			itemsiz += 256;
-			if (!(popitems = realloc(popitems, itemsiz * sizeof(*popitems))))
-				die("cannot realloc %zu bytes:", itemsiz * sizeof(*popitems));
+	while ((len = getline(&line, &linesiz, fp)) != -1) {
+		if (n == popsiz) {
+			popsiz += 256;
+			if (!(pop = realloc(pop, popsiz * sizeof(*pop))))
+				die("cannot realloc %zu bytes:", popsiz * sizeof(*pop));
 		}
-		itemize((struct item*)&popitems[i], line, len);
+		itemize(&pop[n++], line, len);
 	}
 	fclose(fp);
-	if (line)
-		free(line);
+	free(line);
 
-	if (popitems)
-		popitems[i].text = NULL;
-	qsort(popitems, i, sizeof(struct item), compareitembyoutrev);
+	qsort(pop, n, sizeof(*pop), compareitembytext);
+	if (!(texts = malloc((n + 1) * sizeof *texts)) ||
+	    !(ents = malloc((n + 1) * sizeof *ents)))
+		die("malloc:");
+	for (i = j = 0; i < n; i++) {
+		if (j && !strcmp(texts[j - 1], pop[i].text)) {
+			ents[j - 1].count += MAX(pop[i].out, 0);
+			continue;
+		}
+		texts[j] = pop[i].text;
+		ents[j].last = now;
+		ents[j++].count = MAX(pop[i].out, 0);
+	}
+	popwrite(texts, ents, j);
+	for (i = 0; i < n; i++)
+		free(pop[i].text);
+	free(pop);
+	free(texts);
+	free(ents);
+}
+
+static void
+loadpopitems(void)
+{
+	const char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	char *txt;
+	size_t len;
+	int fd, lock;
+
+	if (dir && *dir)
+		len = strlen(dir) + sizeof "/dmenu_pop.db";
+	else if (home)
+		len = strlen(home) + sizeof "/.cache/dmenu_pop.db";
+	else
+		return;
+	if (!(popdb = malloc(len)) || !(txt = malloc(len + 1)))
+		die("malloc:");
+	snprintf(popdb, len, dir && *dir ? "%s/dmenu_pop.db" : "%s/.cache/dmenu_pop.db",
+	         dir && *dir ? dir : home);
+	/* without a usable database, of an older version for example, import
+	 * the text file, only once if several instances start at the same time */
+	if (((fd = open(popdb, O_RDONLY)) < 0 || mappop(fd) < 0) && (lock = lockpop()) >= 0) {
+		if ((fd = open(popdb, O_RDONLY)) < 0 || mappop(fd) < 0) {
+			snprintf(txt, len + 1, dir && *dir ? "%s/dmenu_pop.txt" : "%s/.cache/dmenu_pop.txt",
+			         dir && *dir ? dir : home);
+			importpop(txt);
+			if ((fd = open(popdb, O_RDONLY)) >= 0)
+				mappop(fd);
+		}
+		close(lock);
+	}
+	free(txt);
 }
 
 static void
 usage(void)
 {
-	die("usage: dmenu [-bfiv] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
+	die("usage: dmenu [-bfFiPsv] [-j jobs] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
 	    "             [-nb color] [-nf color] [-sb color] [-sf color] [-w windowid]");
 }
 
@@ -864,7 +2062,7 @@ int
 main(int argc, char *argv[])
 {
 	XWindowAttributes wa;
-	int i, fast = 0;
+	int i, fast = 0, execs = 0;
 
 	for (i = 1; i < argc; i++)
 		/* these options take no arguments */
@@ -875,12 +2073,19 @@ main(int argc, char *argv[])
 			topbar = 0;
 		else if (!strcmp(argv[i], "-f"))   /* grabs keyboard before reading stdin */
 			fast = 1;
-		else if (!strcmp(argv[i], "-i")) { /* case-insensitive item matching */
-			fstrncmp = strncasecmp;
-			fstrstr = cistrstr;
-		} else if (i + 1 == argc)
+		else if (!strcmp(argv[i], "-F"))   /* fuzzy matching, ranked by score */
+			fuzzy = 1;
+		else if (!strcmp(argv[i], "-i"))   /* case-insensitive item matching */
+			fold = 1;
+		else if (!strcmp(argv[i], "-P"))   /* lists the executables in $PATH */
+			execs = 1;
+		else if (!strcmp(argv[i], "-s"))   /* reads stdin while the menu is shown */
+			reading = 1;
+		else if (i + 1 == argc)
 			usage();
 		/* these options take one argument */
+		else if (!strcmp(argv[i], "-j"))   /* number of matcher threads */
+			jobs = atoi(argv[++i]);
 		else if (!strcmp(argv[i], "-l"))   /* number of lines in vertical list */
 			lines = atoi(argv[++i]);
 		else if (!strcmp(argv[i], "-m"))
@@ -904,6 +2109,12 @@ main(int argc, char *argv[])
 
 	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fputs("warning: no locale support\n", stderr);
+	for (i = 0; i < LENGTH(foldtab); i++)
+		foldtab[i] = tolower(i);
+	/* letters of either case and digits get bits of their own */
+	for (i = 0; i < LENGTH(charbits); i++)
+		charbits[i] = 1ULL << (i >= 128 ? 63 : isalpha(i) ? tolower(i) - 'a' :
+		                       isdigit(i) ? 26 + i - '0' : 36 + i % 27);
 	if (!(dpy = XOpenDisplay(NULL)))
 		die("cannot open display");
 	screen = DefaultScreen(dpy);
@@ -917,21 +2128,29 @@ main(int argc, char *argv[])
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
 	lrpad = drw->fonts->h;
+	if (jobs == 0) /* use all online processors */
+		jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
 
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath flock", NULL) == -1)
 		die("pledge");
 #endif
 
-	if (fast && !isatty(0)) {
+	/* before reading, items are ranked as they come in */
+	loadpopitems();
+	if (execs) {
+		reading = 0;
+		readpath();
+		grabkeyboard();
+	} else if (reading) {
+		grabkeyboard();
+	} else if (fast && !isatty(0)) {
 		grabkeyboard();
 		readstdin();
 	} else {
 		readstdin();
 		grabkeyboard();
 	}
-	loadpopitems();
-	sortitemsbypop(items, NULL);
 	setup();
 	run();
 
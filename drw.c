@@ -57,6 +57,8 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->w = w;
 	drw->h = h;
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen),
+	                             DefaultColormap(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -74,17 +76,100 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
+	XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
+	free(drw->glyphs);
+	free(drw->specs);
 	free(drw);
 }
 
+/* forget the glyph cache, the fonts it refers to are about to change */
+static void
+glyph_flush(Drw *drw)
+{
+	memset(drw->latin, 0, sizeof(drw->latin));
+	if (drw->glyphs)
+		memset(drw->glyphs, 0, drw->glyphsize * sizeof(Gly));
+	drw->nglyphs = 0;
+}
+
+static Gly *
+glyph_slot(Gly *glyphs, size_t size, long cp)
+{
+	size_t i = ((unsigned long)cp * 0x9E3779B1UL) & (size - 1);
+
+	while (glyphs[i].font && glyphs[i].cp != cp)
+		i = (i + 1) & (size - 1);
+	return &glyphs[i];
+}
+
+/* Look up the first font of the set having the codepoint cp, whose UTF-8
+ * encoding is str of len bytes, and its advance. Only found glyphs are
+ * cached: a missing one may still be provided by a fallback font later. */
+static Gly *
+glyph_get(Drw *drw, long cp, const char *str, int len)
+{
+	Gly g, *old, *slot;
+	size_t i, oldsize;
+
+	slot = cp < (long)LENGTH(drw->latin) ? &drw->latin[cp]
+	     : drw->glyphs ? glyph_slot(drw->glyphs, drw->glyphsize, cp) : NULL;
+	if (slot && slot->font)
+		return slot;
+
+	for (g.font = drw->fonts; g.font; g.font = g.font->next)
+		if (XftCharExists(drw->dpy, g.font->xfont, cp))
+			break;
+	if (!g.font)
+		return NULL;
+	g.cp = cp;
+	g.index = XftCharIndex(drw->dpy, g.font->xfont, cp);
+	drw_font_getexts(g.font, str, len, &g.w, NULL);
+
+	if (cp >= (long)LENGTH(drw->latin) && (drw->nglyphs + 1) * 4 > drw->glyphsize * 3) {
+		/* keep the load factor below 3/4 */
+		old = drw->glyphs;
+		oldsize = drw->glyphsize;
+		drw->glyphsize = oldsize ? oldsize * 2 : 256;
+		drw->glyphs = ecalloc(drw->glyphsize, sizeof(Gly));
+		for (i = 0; i < oldsize; i++)
+			if (old[i].font)
+				*glyph_slot(drw->glyphs, drw->glyphsize, old[i].cp) = old[i];
+		free(old);
+		slot = glyph_slot(drw->glyphs, drw->glyphsize, cp);
+	}
+	if (cp >= (long)LENGTH(drw->latin))
+		drw->nglyphs++;
+	*slot = g;
+	return slot;
+}
+
+/* queue glyph g at x for drawing by drw_text, centered in a line of h */
+static void
+spec_add(Drw *drw, size_t *n, Gly *g, int x, int y, unsigned int h)
+{
+	XftGlyphFontSpec *spec;
+
+	if (*n == drw->specsize) {
+		drw->specsize = drw->specsize ? drw->specsize * 2 : 128;
+		if (!(drw->specs = realloc(drw->specs, drw->specsize * sizeof(XftGlyphFontSpec))))
+			die("realloc:");
+	}
+	spec = &drw->specs[(*n)++];
+	spec->font = g->font->xfont;
+	spec->glyph = g->index;
+	spec->x = x;
+	spec->y = y + (h - g->font->h) / 2 + g->font->xfont->ascent;
+}
+
 /* This function is an implementation detail. Library users should use
  * drw_fontset_create instead.
  */
@@ -154,6 +239,7 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
+	glyph_flush(drw);
 	return (drw->fonts = ret);
 }
 
@@ -198,8 +284,10 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw && drw->fonts != set) {
+		glyph_flush(drw);
 		drw->fonts = set;
+	}
 }
 
 void
@@ -224,13 +312,13 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
-	int ty, ellipsis_x = 0;
-	unsigned int tmpw, ew, ellipsis_w = 0, ellipsis_len, hash, h0, h1;
-	XftDraw *d = NULL;
+	int i, ellipsis_x = 0;
+	unsigned int tmpw, ew, ellipsis_w = 0, hash, h0, h1;
+	size_t nspecs = 0, runspecs, ellipsis_specs = 0;
+	Gly *g, forced;
 	Fnt *usedfont, *curfont, *nextfont;
 	int utf8strlen, utf8charlen, utf8err, render = x || y || w || h;
 	long utf8codepoint = 0;
-	const char *utf8str;
 	FcCharSet *fccharset;
 	FcPattern *fcpattern;
 	FcPattern *match;
@@ -250,9 +338,6 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
 		if (w < lpad)
 			return x + w;
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
 		x += lpad;
 		w -= lpad;
 	}
@@ -263,39 +348,51 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	if (!invalid_width && render)
 		invalid_width = drw_fontset_getwidth(drw, invalid);
 	while (1) {
-		ew = ellipsis_len = utf8err = utf8charlen = utf8strlen = 0;
-		utf8str = text;
+		ew = utf8err = utf8charlen = utf8strlen = 0;
+		runspecs = nspecs;
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, &utf8err);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
+			if (!charexists && !utf8err) {
+				if ((g = glyph_get(drw, utf8codepoint, text, utf8charlen)))
+					charexists = 1;
+			} else {
+				/* forced to the first font, or an invalid sequence */
+				for (curfont = drw->fonts; curfont; curfont = curfont->next)
+					if ((charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint)))
+						break;
 				if (charexists) {
-					drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
-					if (ew + ellipsis_width <= w) {
-						/* keep track where the ellipsis still fits */
-						ellipsis_x = x + ew;
-						ellipsis_w = w - ew;
-						ellipsis_len = utf8strlen;
-					}
-
-					if (ew + tmpw > w) {
-						overflow = 1;
-						/* called from drw_fontset_getwidth_clamp():
-						 * it wants the width AFTER the overflow
-						 */
-						if (!render)
-							x += tmpw;
-						else
-							utf8strlen = ellipsis_len;
-					} else if (curfont == usedfont) {
-						text += utf8charlen;
-						utf8strlen += utf8err ? 0 : utf8charlen;
-						ew += utf8err ? 0 : tmpw;
-					} else {
-						nextfont = curfont;
-					}
-					break;
+					g = &forced;
+					g->font = curfont;
+					g->index = XftCharIndex(drw->dpy, curfont->xfont, utf8codepoint);
+					drw_font_getexts(curfont, text, utf8charlen, &g->w, NULL);
+				}
+			}
+			if (charexists) {
+				curfont = g->font;
+				tmpw = g->w;
+				if (ew + ellipsis_width <= w) {
+					/* keep track where the ellipsis still fits */
+					ellipsis_x = x + ew;
+					ellipsis_w = w - ew;
+					ellipsis_specs = nspecs;
+				}
+
+				if (ew + tmpw > w) {
+					overflow = 1;
+					/* called from drw_fontset_getwidth_clamp():
+					 * it wants the width AFTER the overflow
+					 */
+					if (!render)
+						x += tmpw;
+				} else if (curfont == usedfont) {
+					if (render && !utf8err)
+						spec_add(drw, &nspecs, g, x + ew, y, h);
+					text += utf8charlen;
+					utf8strlen += utf8err ? 0 : utf8charlen;
+					ew += utf8err ? 0 : tmpw;
+				} else {
+					nextfont = curfont;
 				}
 			}
 
@@ -306,22 +403,38 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		}
 
 		if (utf8strlen) {
-			if (render) {
-				ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-				XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-				                  usedfont->xfont, x, ty, (XftChar8 *)utf8str, utf8strlen);
-			}
 			x += ew;
 			w -= ew;
 		}
 		if (utf8err && (!render || invalid_width < w)) {
-			if (render)
+			if (!render) {
+				/* only measuring */
+			} else if ((g = glyph_get(drw, UTF_INVALID, invalid, sizeof(invalid) - 1))) {
+				spec_add(drw, &nspecs, g, x, y, h);
+			} else {
+				/* only a fallback font has it, which the recursive
+				 * call loads: flush the queue it reuses first */
+				XftDrawGlyphFontSpec(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
+				                     drw->specs, nspecs);
+				nspecs = runspecs = ellipsis_specs = 0;
 				drw_text(drw, x, y, w, h, 0, invalid, invert);
+			}
 			x += invalid_width;
 			w -= invalid_width;
 		}
-		if (render && overflow)
-			drw_text(drw, ellipsis_x, y, ellipsis_w, h, 0, "...", invert);
+		if (render && overflow) {
+			if (!ellipsis_w) {
+				/* no room for the ellipsis, drop the current run */
+				nspecs = runspecs;
+			} else {
+				/* drop what does not fit before the ellipsis */
+				nspecs = MIN(nspecs, ellipsis_specs);
+				XFillRectangle(drw->dpy, drw->drawable, drw->gc, ellipsis_x, y, ellipsis_w, h);
+				if ((g = glyph_get(drw, '.', ".", 1)))
+					for (i = 0; i < 3; i++)
+						spec_add(drw, &nspecs, g, ellipsis_x + i * g->w, y, h);
+			}
+		}
 
 		if (!*text || overflow) {
 			break;
@@ -376,8 +489,9 @@ no_match:
 			}
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
+	if (nspecs)
+		XftDrawGlyphFontSpec(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
+		                     drw->specs, nspecs);
 
 	return x + (render ? w : 0);
 }
@@ -388,8 +502,9 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
+	/* no XSync: waiting for the server is up to the caller, which
+	 * usually only has to flush once all damage is copied */
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
 }
 
 unsigned int
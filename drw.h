@@ -12,6 +12,13 @@ typedef struct Fnt {
 	struct Fnt *next;
 } Fnt;
 
+typedef struct {
+	long cp;
+	Fnt *font; /* first font of the set having cp, NULL if not cached */
+	FT_UInt index;
+	unsigned int w;
+} Gly;
+
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
@@ -21,9 +28,15 @@ typedef struct {
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	Gly latin[256]; /* glyph cache, codepoints below 256 */
+	Gly *glyphs;    /* glyph cache, other codepoints by hash */
+	size_t nglyphs, glyphsize;
+	XftGlyphFontSpec *specs; /* glyphs of the text being drawn */
+	size_t specsize;
 } Drw;
 
 /* Drawable abstraction */
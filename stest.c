@@ -2,71 +2,402 @@
 #include <sys/stat.h>
 
 #include <dirent.h>
-#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "arg.h"
 char *argv0;
 
 #define FLAG(x)  (flag[(x)-'a'])
+#ifdef DTTOIF
+#define DTYPE(d) DTTOIF((d)->d_type) /* file type bits of an entry, 0 if unknown */
+#else
+#define DTYPE(d) 0
+#endif
 
-static void test(const char *, const char *);
+/* names passing the tests for one argument, printed in argument order */
+struct scan {
+	const char *arg;
+	char *out;
+	size_t len, size;
+	size_t n; /* names in out */
+	struct timespec mtim; /* of the directory before it was read */
+	int dir;   /* the contents of a directory, to be cached */
+	int fresh; /* read, not taken from the cache */
+	int done;
+};
+
+/* the names of a directory as read from the cache file */
+struct cached {
+	const char *path;
+	long long sec;
+	long nsec;
+	const char *names;
+	size_t len, n;
+};
+
+static int test(int, const char *, const char *, mode_t);
 static void usage(void);
 
 static int match = 0;
 static int flag[26];
+static int uniq = 0; /* print sorted and without duplicates */
+static char *cachefile;
+static char cachekey[40]; /* flags of the tests the cache holds results of */
+static char *cachebuf;
+static struct cached *cache;
+static size_t ncache;
 static struct stat old, new;
+static struct scan *scans;
+static int nscans, nextscan;
+static pthread_mutex_t scanlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scandone = PTHREAD_COND_INITIALIZER;
 
-static void
-test(const char *path, const char *name)
+/* path is relative to the directory fd, or AT_FDCWD; type is the file
+ * type as told by readdir(), 0 if not known */
+static int
+test(int fd, const char *path, const char *name, mode_t type)
 {
 	struct stat st, ln;
 
-	if ((!stat(path, &st) && (FLAG('a') || name[0] != '.')        /* hidden files      */
+	/* the type of anything but a link is all the inode is needed for,
+	 * unless one of the tests looks at its mode bits, time or size */
+	if (type && !S_ISLNK(type) && !FLAG('g') && !FLAG('n') && !FLAG('o')
+	&& !FLAG('s') && !FLAG('u'))
+		st.st_mode = type;
+	else if (fstatat(fd, path, &st, 0))
+		return FLAG('v');
+
+	return ((FLAG('a') || name[0] != '.')                         /* hidden files      */
 	&& (!FLAG('b') || S_ISBLK(st.st_mode))                        /* block special     */
 	&& (!FLAG('c') || S_ISCHR(st.st_mode))                        /* character special */
 	&& (!FLAG('d') || S_ISDIR(st.st_mode))                        /* directory         */
-	&& (!FLAG('e') || access(path, F_OK) == 0)                    /* exists            */
+	&& (!FLAG('e') || faccessat(fd, path, F_OK, 0) == 0)          /* exists            */
 	&& (!FLAG('f') || S_ISREG(st.st_mode))                        /* regular file      */
 	&& (!FLAG('g') || st.st_mode & S_ISGID)                       /* set-group-id flag */
-	&& (!FLAG('h') || (!lstat(path, &ln) && S_ISLNK(ln.st_mode))) /* symbolic link     */
+	&& (!FLAG('h') || (type ? S_ISLNK(type)                       /* symbolic link     */
+	    : !fstatat(fd, path, &ln, AT_SYMLINK_NOFOLLOW) && S_ISLNK(ln.st_mode)))
 	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                 /* newer than file   */
 	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                 /* older than file   */
 	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                       /* named pipe        */
-	&& (!FLAG('r') || access(path, R_OK) == 0)                    /* readable          */
+	&& (!FLAG('r') || faccessat(fd, path, R_OK, 0) == 0)          /* readable          */
 	&& (!FLAG('s') || st.st_size > 0)                             /* not empty         */
 	&& (!FLAG('u') || st.st_mode & S_ISUID)                       /* set-user-id flag  */
-	&& (!FLAG('w') || access(path, W_OK) == 0)                    /* writable          */
-	&& (!FLAG('x') || access(path, X_OK) == 0)) != FLAG('v')) {   /* executable        */
-		if (FLAG('q'))
-			exit(0);
+	&& (!FLAG('w') || faccessat(fd, path, W_OK, 0) == 0)          /* writable          */
+	&& (!FLAG('x') || faccessat(fd, path, X_OK, 0) == 0))         /* executable        */
+	!= FLAG('v');
+}
+
+static void
+keep(struct scan *s, const char *buf, size_t len)
+{
+	if (s->len + len > s->size) {
+		s->size = 2 * (s->len + len);
+		if (!(s->out = realloc(s->out, s->size))) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	memcpy(s->out + s->len, buf, len);
+	s->len += len;
+}
+
+/* print name, or keep it in s to be printed later */
+static void
+pass(struct scan *s, const char *name)
+{
+	if (FLAG('q'))
+		exit(0);
+	if (!s) {
 		match = 1;
 		puts(name);
+		return;
+	}
+	keep(s, name, strlen(name));
+	keep(s, "\n", 1);
+	s->n++;
+}
+
+static int
+comparename(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/* print the names kept in the n scans sorted, each once, in one write */
+static void
+printuniq(struct scan *s, int n)
+{
+	char **v, *buf, *p, *nl;
+	size_t i, nv = 0, len = 0;
+	int j;
+
+	for (j = 0; j < n; j++)
+		nv += s[j].n;
+	if (!(v = malloc((nv + 1) * sizeof *v))) {
+		perror("malloc");
+		exit(2);
+	}
+	for (nv = 0, j = 0; j < n; j++)
+		for (p = s[j].out; p < s[j].out + s[j].len; p = nl + 1) {
+			nl = memchr(p, '\n', s[j].out + s[j].len - p);
+			*nl = '\0';
+			v[nv++] = p;
+		}
+	qsort(v, nv, sizeof *v, comparename);
+	for (j = 0; j < n; j++)
+		len += s[j].len;
+	if (!(buf = malloc(len + 1))) {
+		perror("malloc");
+		exit(2);
+	}
+	for (len = 0, i = 0; i < nv; i++) {
+		if (i && !strcmp(v[i], v[i - 1]))
+			continue;
+		p = stpcpy(buf + len, v[i]);
+		*p = '\n';
+		len = p + 1 - buf;
+	}
+	if (len)
+		match = 1;
+	fwrite(buf, 1, len, stdout);
+	free(buf);
+	free(v);
+}
+
+static struct cached *
+lookup(const char *path)
+{
+	size_t i;
+
+	for (i = 0; i < ncache; i++)
+		if (!strcmp(cache[i].path, path))
+			return &cache[i];
+	return NULL;
+}
+
+static void
+scan(const char *arg, struct scan *s)
+{
+	struct cached *c;
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+
+	if (FLAG('l') && cachefile && s && !stat(arg, &st) && S_ISDIR(st.st_mode)) {
+		/* a directory is modified whenever an entry is added,
+		 * removed or renamed; until then its names are cached.
+		 * One modified just now may change again without its
+		 * timestamp changing, so it is read again next time. */
+		s->mtim = st.st_mtim;
+		s->dir = !strchr(arg, '\n') && st.st_mtim.tv_sec < time(NULL) - 1;
+		if ((c = lookup(arg)) && c->sec == st.st_mtim.tv_sec &&
+		    c->nsec == st.st_mtim.tv_nsec) {
+			if (FLAG('q') && c->n)
+				exit(0);
+			keep(s, c->names, c->len);
+			s->n = c->n;
+			return;
+		}
 	}
+	if (FLAG('l') && (dir = opendir(arg))) {
+		/* test directory contents, relative to it */
+		while ((d = readdir(dir)))
+			if (test(dirfd(dir), d->d_name, d->d_name, DTYPE(d)))
+				pass(s, d->d_name);
+		closedir(dir);
+		if (s)
+			s->fresh = 1;
+	} else {
+		if (s)
+			s->dir = 0;
+		if (test(AT_FDCWD, arg, arg, 0))
+			pass(s, arg);
+	}
+}
+
+/* read the cache file: a line with the flags it was made with, then for
+ * each directory a line with its mtime, the number of names and its
+ * path, followed by the names, one per line */
+static void
+readcache(void)
+{
+	struct cached c, *p;
+	struct stat st;
+	FILE *fp;
+	char *s, *end, *nl;
+	size_t i;
+
+	if (!(fp = fopen(cachefile, "r")))
+		return;
+	if (fstat(fileno(fp), &st) < 0 || !(cachebuf = malloc(st.st_size + 1)) ||
+	    fread(cachebuf, 1, st.st_size, fp) != (size_t)st.st_size) {
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+	cachebuf[st.st_size] = '\0';
+	end = cachebuf + st.st_size;
+	/* made for other tests */
+	if (!(nl = memchr(cachebuf, '\n', st.st_size)) ||
+	    strncmp(cachebuf, cachekey, nl - cachebuf) || cachekey[nl - cachebuf])
+		return;
+	for (s = nl + 1; s < end; ncache++) {
+		c.sec = strtoll(s, &s, 10);
+		c.nsec = strtol(s, &s, 10);
+		c.n = strtoul(s, &s, 10);
+		if (*s++ != ' ' || !(nl = memchr(s, '\n', end - s)))
+			return;
+		*nl = '\0';
+		c.path = s;
+		for (c.names = s = nl + 1, i = 0; i < c.n; i++, s = nl + 1)
+			if (!(nl = memchr(s, '\n', end - s)))
+				return;
+		c.len = s - c.names;
+		if (!(p = realloc(cache, (ncache + 1) * sizeof *cache))) {
+			perror("realloc");
+			exit(2);
+		}
+		cache = p;
+		cache[ncache] = c;
+	}
+}
+
+static void
+writecache(struct scan *s, int n)
+{
+	char *tmp;
+	FILE *fp = NULL;
+	int fd, i;
+
+	if (!(tmp = malloc(strlen(cachefile) + sizeof ".XXXXXX"))) {
+		perror("malloc");
+		exit(2);
+	}
+	sprintf(tmp, "%s.XXXXXX", cachefile);
+	if ((fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(cachefile);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return;
+	}
+	fprintf(fp, "%s\n", cachekey);
+	for (i = 0; i < n; i++) {
+		if (!s[i].dir)
+			continue;
+		fprintf(fp, "%lld %ld %zu %s\n", (long long)s[i].mtim.tv_sec,
+		        s[i].mtim.tv_nsec, s[i].n, s[i].arg);
+		fwrite(s[i].out, 1, s[i].len, fp);
+	}
+	if (ferror(fp) | (fclose(fp) == EOF) || rename(tmp, cachefile) < 0) {
+		perror(cachefile);
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+static void *
+worker(void *arg)
+{
+	struct scan *s;
+
+	for (;;) {
+		pthread_mutex_lock(&scanlock);
+		s = nextscan < nscans ? &scans[nextscan++] : NULL;
+		pthread_mutex_unlock(&scanlock);
+		if (!s)
+			return NULL;
+		scan(s->arg, s);
+		pthread_mutex_lock(&scanlock);
+		s->done = 1;
+		pthread_cond_broadcast(&scandone);
+		pthread_mutex_unlock(&scanlock);
+	}
+}
+
+/* scan the arguments with jobs threads, printing in argument order */
+static void
+scanall(char *argv[], int argc, int jobs)
+{
+	pthread_t *tid;
+	int i, n, fresh = 0;
+
+	if (!(scans = calloc(argc, sizeof *scans)) ||
+	    !(tid = calloc(jobs, sizeof *tid))) {
+		perror("calloc");
+		exit(2);
+	}
+	for (i = 0; i < argc; i++)
+		scans[i].arg = argv[i];
+	nscans = argc;
+	for (n = 0; jobs > 1 && n < jobs && n < argc; n++)
+		if (pthread_create(&tid[n], NULL, worker, NULL))
+			break;
+	if (!n)
+		worker(NULL);
+	for (i = 0; i < argc; i++) {
+		pthread_mutex_lock(&scanlock);
+		while (!scans[i].done)
+			pthread_cond_wait(&scandone, &scanlock);
+		pthread_mutex_unlock(&scanlock);
+		if (uniq)
+			continue;
+		if (scans[i].len)
+			match = 1;
+		fwrite(scans[i].out, 1, scans[i].len, stdout);
+	}
+	while (n--)
+		pthread_join(tid[n], NULL);
+	/* rewrite the cache once a directory had to be read again, before
+	 * printuniq() splits the names */
+	for (i = 0; cachefile && i < argc; i++)
+		fresh |= scans[i].dir && scans[i].fresh;
+	if (fresh)
+		writecache(scans, argc);
+	if (uniq)
+		printuniq(scans, argc);
+	for (i = 0; i < argc; i++)
+		free(scans[i].out);
+	free(tid);
+	free(scans);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-abcdefghlpqrsuvwx] "
-	        "[-n file] [-o file] [file...]\n", argv0);
+	fprintf(stderr, "usage: %s [-abcdefghlpqrsuvwxU] [-C file] "
+	        "[-j jobs] [-n file] [-o file] [file...]\n", argv0);
 	exit(2); /* like test(1) return > 1 on error */
 }
 
 int
 main(int argc, char *argv[])
 {
-	struct dirent *d;
-	char path[PATH_MAX], *line = NULL, *file;
+	struct scan in = { 0 };
+	char *line = NULL, *file;
 	size_t linesiz = 0;
 	ssize_t n;
-	DIR *dir;
-	int r;
+	int i, jobs = 1;
 
 	ARGBEGIN {
+	case 'C': /* cache of the directory contents */
+		cachefile = EARGF(usage());
+		break;
+	case 'j': /* threads scanning the arguments */
+		if ((jobs = atoi(EARGF(usage()))) <= 0) /* one per processor */
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		break;
+	case 'U': /* sorted unique output */
+		uniq = 1;
+		break;
 	case 'n': /* newer than file */
 	case 'o': /* older than file */
 		file = EARGF(usage());
@@ -81,29 +412,34 @@ main(int argc, char *argv[])
 			usage(); /* unknown flag */
 	} ARGEND;
 
+	/* the results also depend on the files given with -n and -o */
+	if (FLAG('n') || FLAG('o') || !FLAG('l'))
+		cachefile = NULL;
+	if (cachefile) {
+		strcpy(cachekey, "stest -");
+		for (i = 0; i < 26; i++)
+			if (flag[i])
+				cachekey[strlen(cachekey)] = 'a' + i;
+		readcache();
+	}
+
 	if (!argc) {
 		/* read list from stdin */
 		while ((n = getline(&line, &linesiz, stdin)) > 0) {
 			if (line[n - 1] == '\n')
 				line[n - 1] = '\0';
-			test(line, line);
+			if (test(AT_FDCWD, line, line, 0))
+				pass(uniq ? &in : NULL, line);
 		}
 		free(line);
+		if (uniq)
+			printuniq(&in, 1);
+		free(in.out);
+	} else if (uniq || cachefile || (jobs > 1 && argc > 1)) {
+		scanall(argv, argc, jobs);
 	} else {
-		for (; argc; argc--, argv++) {
-			if (FLAG('l') && (dir = opendir(*argv))) {
-				/* test directory contents */
-				while ((d = readdir(dir))) {
-					r = snprintf(path, sizeof path, "%s/%s",
-					             *argv, d->d_name);
-					if (r >= 0 && (size_t)r < sizeof path)
-						test(path, d->d_name);
-				}
-				closedir(dir);
-			} else {
-				test(*argv, *argv);
-			}
-		}
+		for (; argc; argc--, argv++)
+			scan(*argv, NULL);
 	}
 	return match ? 0 : 1;
 }